@@ -438,6 +438,124 @@ sub CMD_SKIP ()           { "CMD_SKIP" }
       CMD_CLEANUP => 'sleep 0.25'],
 
 
+# Fan-out
+    [ 'Test FANOUT1',
+      'fan-out to two consumers',
+      'seq 1000 |&| wc -l > f%%.txt |&| tail -n 1 ; cat f%%.txt',
+      '1000 1000' ],
+
+    [ 'Test FANOUT2',
+      'fan-out to three consumers',
+      'cat f%%.txt |&| cmp - f%%.txt > f%%a.txt |&| wc -c > f%%b.txt |&| tail -n 1 ; cat f%%a.txt f%%b.txt',
+      '200000 1288895',
+      CMD_INIT => 'seq 200000 > f%%.txt' ],
+
+    [ 'Test FANOUT3',
+      'fan-out consumer exits early',
+      'seq 100000 |&| head -n 1 > f%%.txt |&| wc -l ; cat f%%.txt',
+      '100000 1' ],
+
+    [ 'Test FANOUT4',
+      'fan-out status',
+      'echo x |&| true |&| false && echo Bad || echo Good',
+      'Good' ],
+
+    [ 'Test FANOUT5',
+      'fan-out into loop and parallel consumers',
+      'echo hi |&| for i in 1 2 ; do echo $i | cat ; done > f%%.txt |&| parallel -k echo x > f%%a.txt |&| cat ; cat f%%.txt f%%a.txt',
+      'hi 1 2 x hi' ],
+
+    [ 'Test FANOUT6',
+      'fan-out missing consumer',
+      "echo x |&|\necho y |\necho Done",
+      'syntax error syntax error Done',
+      CMD_CLEANUP => 'perl -pi -e "s,^.*:\s*,," out%%.txt' ],
+
+    [ 'Test FANOUT7',
+      'fan-out pump is reaped',
+      "seq 3 |&| cat > /dev/null |&| cat > /dev/null ; sh -c 'ps -o stat=,comm= --ppid \$PPID'",
+      '',
+      CMD_OUTPUT_FILTER => 'grep Z'],
+
+    [ 'Test FANOUT8',
+      'fan-out to a slow consumer',
+      'seq 300000 |&| sh -c "sleep 0.2; cksum" > f%%.txt |&| cksum > f%%a.txt |&| cksum ; cat f%%.txt f%%a.txt',
+      '2732413854 1988895 2732413854 1988895 2732413854 1988895' ],
+
+
+# Process substitution
+    [ 'Test PROCSUB1',
+      'input process substitutions',
+      'paste <(sort f%%.txt) <(sort -r f%%.txt)',
+      'a c b b c a',
+      CMD_FILE => [ "f%%.txt" => "b\nc\na" ] ],
+
+    [ 'Test PROCSUB2',
+      'output process substitution',
+      'seq 5 | tee >(wc -l > f%%.txt) > /dev/null ; cat f%%.txt',
+      '5' ],
+
+    [ 'Test PROCSUB3',
+      'process substitution file descriptors',
+      'cat <(ls /proc/self/fd) | wc -l ; sh -c "ls /proc/self/fd" <(true) | wc -l',
+      '4 5' ],
+
+    [ 'Test PROCSUB4',
+      'process substitution as redirection target',
+      "echo Hello > >(tr H J > f%%.txt) ; wc -l < <(seq 3) ; cat f%%.txt\necho x >",
+      '3 Jello syntax error',
+      CMD_CLEANUP => 'perl -pi -e "s,^.*:\s*,," out%%.txt' ],
+
+
+# Result cache
+    [ 'Test CACHED1',
+      'cached output replay',
+      'cached -d c%% sort f%%.txt > g%%.txt ; cached -d c%% sort f%%.txt ; cat g%%.txt ; cached -d c%% -s',
+      'a b c a b c cached: 1 hits, 1 misses (50.0% hit rate)',
+      CMD_FILE => [ "f%%.txt" => "b\nc\na" ],
+      CMD_INIT => 'rm -rf c%%' ],
+
+    [ 'Test CACHED2',
+      'cached input change',
+      'cached -d c%% wc -l < f%%.txt ; cp g%%.txt f%%.txt ; cached -d c%% wc -l < f%%.txt ; cached -d c%% wc -l < f%%.txt ; cached -d c%% -s',
+      '1 2 2 cached: 1 hits, 2 misses (33.3% hit rate)',
+      CMD_FILE => [ "f%%.txt" => "one", "g%%.txt" => "one\ntwo" ],
+      CMD_INIT => 'rm -rf c%%' ],
+
+    [ 'Test CACHED3',
+      'cached status replay',
+      'cached -d c%% grep x f%%.txt || echo A ; cached -d c%% grep x f%%.txt || echo B ; cached -d c%% -s',
+      'A B cached: 1 hits, 1 misses (50.0% hit rate)',
+      CMD_FILE => [ "f%%.txt" => "y" ],
+      CMD_INIT => 'rm -rf c%%' ],
+
+    [ 'Test CACHED4',
+      'cached skips terminal input',
+      'cached -d c%% echo a < /dev/tty ; cached -d c%% echo a < /dev/tty ; cached -d c%% echo a < /dev/null ; cached -d c%% echo a < /dev/null ; cached -d c%% -s',
+      'a a a a cached: 1 hits, 1 misses (50.0% hit rate)',
+      CMD_INIT => 'rm -rf c%%' ],
+
+    [ 'Test CACHED5',
+      'cached from a script run at a terminal',
+      "cached -d c%% sort f%%.txt > g%%.txt\ncached -d c%% sort f%%.txt > g%%.txt\ncached -d c%% -s\ncat g%%.txt",
+      'cached: 1 hits, 1 misses (50.0% hit rate) a b',
+      CMD_FILE => [ "f%%.txt" => "b\na" ],
+      CMD_INIT => 'rm -rf c%%',
+      CMD_SCRIPT_FILE => 1 ],
+
+    [ 'Test CACHED6',
+      'cached skips pipe words and keys directories',
+      'cached -d c%% cat <(echo A) ; cached -d c%% cat <(echo B) ; cached -d c%% ls d%% ; touch d%%/2 ; cached -d c%% ls d%% ; cached -d c%% -s',
+      'A B 1 1 2 cached: 0 hits, 2 misses (0.0% hit rate)',
+      CMD_INIT => 'rm -rf c%% d%% ; mkdir d%% ; touch d%%/1' ],
+
+    [ 'Test CACHED7',
+      'cached skips terminal output',
+      'cached -d c%% true > /dev/tty ; cached -d c%% true > /dev/tty ; cached -d c%% -s',
+      'cached: 0 hits, 0 misses (0.0% hit rate)',
+      CMD_INIT => 'rm -rf c%%' ],
+
+
 # Zombies
     [ 'Test ZOMBIE1',
       'simple zombie cleanup',
@@ -608,6 +726,80 @@ sub CMD_SKIP ()           { "CMD_SKIP" }
       '/' ],
 
 
+# Loops
+    [ 'Test LOOP1',
+      'for loop',
+      'for i in a b c ; do echo $i ; done',
+      'a b c' ],
+
+    [ 'Test LOOP2',
+      'nested for loops',
+      'for i in 1 2 ; do for j in x y ; do echo $i${j} ; done ; done',
+      '1x 1y 2x 2y' ],
+
+    [ 'Test LOOP3',
+      'while and until loops',
+      'rm -f f%%.txt ; until test -e f%%.txt ; do echo made > f%%.txt ; done ; while test -e f%%.txt ; do cat f%%.txt ; rm f%%.txt ; done',
+      'made' ],
+
+    [ 'Test LOOP4',
+      'loop status and pipeline',
+      'for i in a b ; do echo $i ; false ; done | tr ab AB || echo Bad ; for i in a ; do false ; done || echo Good',
+      'A B Good' ],
+
+    [ 'Test LOOP5',
+      'cd inside loop',
+      'cd / ; for d in tmp usr ; do cd $d ; pwd ; cd .. ; done',
+      '/tmp /usr' ],
+
+    [ 'Test LOOP6',
+      'loops across lines',
+      "for i in a b\ndo\n  echo \$i\n  # comment\n  for j in 1 2 ; do\n    echo \$i\$j\n  done\ndone\n\nwhile false\ndo echo Bad ; done ; echo End",
+      'a a1 a2 b b1 b2 End',
+      CMD_SCRIPT_FILE => 1 ],
+
+    [ 'Test LOOP7',
+      'unclosed loop',
+      "echo Start\nfor i in a b ; do\necho \$i",
+      'Start syntax error',
+      CMD_SCRIPT_FILE => 1,
+      CMD_CLEANUP => 'perl -pi -e "s,^.*:\s*,," out%%.txt' ],
+
+    [ 'Test LOOP8',
+      'quoted loop variables',
+      'for i in a ; do echo $i "$i" \'$i\' \\$i ; done ; echo \'$i\'',
+      'a a $i $i $i' ],
+
+    [ 'Test LOOP9',
+      'last script line without a newline',
+      '../sh61 -q s%%.sh',
+      'a 1 2',
+      CMD_INIT => 'printf "echo a\\nfor i in 1 2\\ndo echo \\$i\\ndone" > s%%.sh' ],
+
+
+# parallel
+    [ 'Test PARALLEL1',
+      'parallel with ordered output',
+      'seq 4 | parallel -j 3 -k sh -c "sleep 0.0$((5 - {})) ; echo item {}"',
+      'item 1 item 2 item 3 item 4' ],
+
+    [ 'Test PARALLEL2',
+      'parallel items from file',
+      'parallel -j2 -k -a f%%.txt echo x',
+      'x a b x c',
+      CMD_FILE => [ "f%%.txt" => "a b\nc" ] ],
+
+    [ 'Test PARALLEL3',
+      'parallel status',
+      'seq 3 | parallel -j 2 test 2 -ne || echo Failed ; seq 3 | parallel true && echo Passed',
+      'Failed Passed' ],
+
+    [ 'Test PARALLEL4',
+      'parallel job exits after closing its output',
+      'seq 3 | parallel -j 2 sh -c "exec > /dev/null; sleep 0.1; echo $0 >&2" 2> f%%.txt ; sort f%%.txt',
+      '1 2 3' ],
+
+
 # Interrupts
     [ 'Test INTR1',
       'interrupt stopping conditional',
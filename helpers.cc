@@ -19,18 +19,18 @@ shell_parser::shell_parser(const char* str)
         ++_str;
     }
     if (*_str == '#') {
-        _str = _estr;
+        _str += strcspn(_str, "\n");
     }
 }
 
 void shell_token_iterator::update() {
-    // Skip initial spaces
-    while (isspace((unsigned char) *_s)) {
+    // Skip initial spaces; a newline is a token
+    while (isspace((unsigned char) *_s) && *_s != '\n') {
         ++_s;
     }
     // Skip to end of line if comment
     if (*_s == '#') {
-        _s += strlen(_s);
+        _s += strcspn(_s, "\n");
     }
 
     _len = 0;
@@ -43,7 +43,14 @@ void shell_token_iterator::update() {
     while (isdigit((unsigned char) _s[_len])) {
         ++_len;
     }
-    if (_s[_len] == '<' || _s[_len] == '>') {
+    if (_len == 0
+        && (_s[0] == '<' || _s[0] == '>')
+        && _s[1] == '(') {
+        // Process substitution
+        _len = 2;
+        _type = TYPE_PROCSUB;
+
+    } else if (_s[_len] == '<' || _s[_len] == '>') {
         // Redirection
         ++_len;
         if (_s[_len] == '>') {
@@ -55,6 +62,12 @@ void shell_token_iterator::update() {
         }
         _type = TYPE_REDIRECT_OP;
 
+    } else if (_len == 0
+               && _s[0] == '|' && _s[1] == '&' && _s[2] == '|') {
+        // Fan-out operator
+        _len = 3;
+        _type = TYPE_FANOUT;
+
     } else if (_len == 0
                && (_s[0] == '&' || _s[0] == '|')
                && _s[1] == _s[0]) {
@@ -80,6 +93,12 @@ void shell_token_iterator::update() {
             _type = TYPE_OTHER;
         }
 
+    } else if (_len == 0
+               && _s[0] == '\n') {
+        // Newline ends a command like `;`
+        _len = 1;
+        _type = TYPE_SEQUENCE;
+
     } else if (_len == 0
                && _s[0] == '\0') {
         // End of string
@@ -135,6 +154,40 @@ std::string shell_token_iterator::str() const {
 }
 
 
+// shell_token_iterator::word()
+//    Return the token's contents like `str()`, but with `LITERAL_DOLLAR`
+//    before each `$` that was single-quoted or escaped with a backslash.
+
+std::string shell_token_iterator::word() const {
+    if (!_quoted || !memchr(_s, '$', _len)) {
+        return str();
+    }
+    std::ostringstream build;
+    int curquote = 0;
+    for (unsigned pos = 0; pos != _len; ++pos) {
+        if ((_s[pos] == '\"' || _s[pos] == '\'') && !curquote) {
+            curquote = _s[pos];
+        } else if (_s[pos] == curquote) {
+            curquote = 0;
+        } else if (_s[pos] == '\\'
+                   && _s[pos+1] != '\0'
+                   && curquote != '\'') {
+            if (_s[pos+1] == '$') {
+                build << LITERAL_DOLLAR;
+            }
+            build << _s[pos+1];
+            ++pos;
+        } else {
+            if (_s[pos] == '$' && curquote == '\'') {
+                build << LITERAL_DOLLAR;
+            }
+            build << _s[pos];
+        }
+    }
+    return build.str();
+}
+
+
 // claim_foreground(pgid)
 //    Mark `pgid` as the current foreground process group for this terminal.
 //    This uses some ugly Unix warts, so we provide it for you.
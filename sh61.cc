@@ -2,6 +2,16 @@
 #include <cstring>
 #include <cerrno>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <ctime>
+#include <climits>
+#include <dirent.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -9,6 +19,26 @@
 #undef exit
 #define exit __DO_NOT_CALL_EXIT__READ_PROBLEM_SET_DESCRIPTION__
 
+// Loop kinds for `command::loop`
+#define LOOP_NONE          0   // ordinary command
+#define LOOP_FOR           1   // `for name in words; do list; done`
+#define LOOP_WHILE         2   // `while list; do list; done`
+#define LOOP_UNTIL         3   // `until list; do list; done`
+
+struct command;
+
+
+// struct procsub
+//    A `<(list)` or `>(list)` process substitution in a command's words.
+
+struct procsub {
+    size_t arg;                   // index of the substituted word in `args`
+    std::string* path = nullptr;  // redirection path it replaces instead
+    bool write;                   // true for `>(list)`
+    command* list;                // list run with its stdout or stdin piped
+    pid_t pid = -1;               // process ID running `list`
+};
+
 
 // struct command
 //    Data structure describing a command. Add your own stuff.
@@ -23,6 +53,8 @@ struct command {
 
     // Pipes
     int pfd[2];
+    bool fanout = false;          // stdout feeds the `|&|` pump
+    int fanin = -1;               // stdin pipe from the `|&|` pump, if any
 
     // Redirects
     bool in = false;
@@ -32,14 +64,40 @@ struct command {
     std::string outpath;
     std::string errpath;
 
+    // Process substitutions
+    std::vector<procsub> procsubs;
+
     // Vars for all commands
     command* next = nullptr;
     command* prev = nullptr;
     int link = TYPE_SEQUENCE;
 
+    // Loops: a loop command has no `args`; its lists are parsed once and
+    // run repeatedly by `run_loop`
+    int loop = LOOP_NONE;
+    std::string var;                  // `for` loop variable
+    std::vector<std::string> words;   // `for` loop word list
+    command* cond = nullptr;          // `while`/`until` condition list
+    command* body = nullptr;          // loop body list
+
     void run();
 };
 
+void run_list(command* c);
+void run_loop(command* c);
+int run_parallel(const std::vector<std::string>& argv);
+int run_cached(const std::vector<std::string>& argv);
+
+// Wait status of the most recently completed pipeline or loop
+int last_status = 0;
+
+// Loop variable bindings, set by `for` loops and expanded in command words
+std::map<std::string, std::string> bindings;
+
+// File descriptors the shell keeps for itself while children run, such as
+// the ends of `|&|` pump pipes. Child processes close them.
+std::vector<int> shell_fds;
+
 
 // command::command()
 //    This constructor function initializes a `command` structure. You may
@@ -54,9 +112,28 @@ command::command() {
 
 command::~command() {
     delete next;
+    delete cond;
+    delete body;
+    for (auto& p : procsubs) {
+        delete p.list;
+    }
 }
 
 
+// Helper function writing all of `s` to `fd`; returns false on error
+bool write_all(int fd, const std::string& s) {
+    size_t pos = 0;
+    while (pos < s.size()) {
+        ssize_t n = write(fd, s.data() + pos, s.size() - pos);
+        if (n == -1 && errno != EINTR) {
+            return false;
+        } else if (n > 0) {
+            pos += n;
+        }
+    }
+    return true;
+}
+
 // Helper function for handling failed syscalls
 void error_msg() {
     fprintf(stderr, "%m\n");
@@ -76,6 +153,62 @@ void redir(std::string path, int flags, int data_stream) {
     }
 }
 
+// Expand `$name` and `${name}` references to bound loop variables in `s`.
+// References to unbound names, and quoted `$`s (marked by the parser with
+// `LITERAL_DOLLAR`), are left as they are.
+std::string expand(const std::string& s) {
+    if (s.find('$') == std::string::npos) {
+        return s;
+    }
+    std::string result;
+    size_t i = 0;
+    while (i < s.size()) {
+        if (s[i] == LITERAL_DOLLAR && i + 1 < s.size() && s[i + 1] == '$') {
+            result += '$';
+            i += 2;
+            continue;
+        } else if (s[i] != '$') {
+            result += s[i];
+            ++i;
+            continue;
+        }
+        bool brace = i + 1 < s.size() && s[i + 1] == '{';
+        size_t start = i + 1 + brace;
+        size_t end = start;
+        while (end < s.size()
+               && (s[end] == '_' || isalnum((unsigned char) s[end]))
+               && !(end == start && isdigit((unsigned char) s[end]))) {
+            ++end;
+        }
+        auto b = bindings.end();
+        if (end > start && (!brace || (end < s.size() && s[end] == '}'))) {
+            b = bindings.find(s.substr(start, end - start));
+        }
+        if (b != bindings.end()) {
+            result += b->second;
+            i = end + brace;
+        } else {
+            result += '$';
+            ++i;
+        }
+    }
+    return result;
+}
+
+// Helper function closing every file descriptor above stderr except those
+// in `keep`
+void close_other_fds(std::vector<int> keep) {
+    std::sort(keep.begin(), keep.end());
+    unsigned lo = 3;
+    for (int fd : keep) {
+        if (fd > (int) lo) {
+            close_range(lo, fd - 1, 0);
+        }
+        lo = std::max(lo, (unsigned) fd + 1);
+    }
+    close_range(lo, ~0U, 0);
+}
+
 void connect_pipes(command* c, int pfd_end, int data_stream) {
     if (dup2(c->pfd[pfd_end], data_stream) == -1) {
         error_msg();
@@ -110,13 +243,61 @@ void connect_pipes(command* c, int pfd_end, int data_stream) {
 //       standard input/output with parts of the pipe (`dup2` and `close`).
 //       Draw pictures!
 //    PART 7: Handle redirections.
+//
+//    Each process substitution starts its list in a child before the
+//    command itself, connected by a pipe. The command gets `/dev/fd/N` for
+//    its end of the pipe, which stays open across `execvp`; the command
+//    closes every other descriptor above stderr.
+//
+//    Loop commands normally run inside the shell (see `run_pipeline`); they
+//    come here only when piped or redirected, and then run in a subshell.
 
 void command::run() {
     assert(this->pid == -1);
-    assert(this->args.size() > 0);
+    assert(this->args.size() > 0 || this->loop);
+
+    // Expand loop variables in the words of this command
+    std::vector<std::string> argv;
+    for (auto& a : this->args) {
+        argv.push_back(expand(a));
+    }
+
+    // Start process substitutions before creating this command's pipe, so
+    // they never hold its write end
+    std::vector<int> subfds;
+    for (auto& p : this->procsubs) {
+        int sfd[2];
+        if (pipe(sfd) == -1) {
+            error_msg();
+        }
+        int mine = sfd[p.write ? 1 : 0];
+        int theirs = sfd[p.write ? 0 : 1];
+        p.pid = fork();
+        if (p.pid == -1) {
+            error_msg();
+        }
+        if (p.pid == 0) {
+            if (dup2(theirs, p.write ? STDIN_FILENO : STDOUT_FILENO) == -1) {
+                error_msg();
+            }
+            close_other_fds({});
+            shell_fds.clear();
+            run_list(p.list);
+            _exit(WIFEXITED(last_status) ? WEXITSTATUS(last_status) : EXIT_FAILURE);
+        }
+        if (close(theirs) == -1) {
+            error_msg();
+        }
+        if (p.path) {
+            *p.path = "/dev/fd/" + std::to_string(mine);
+        } else {
+            argv[p.arg] = "/dev/fd/" + std::to_string(mine);
+        }
+        subfds.push_back(mine);
+    }
 
     // Create a pipe if needed
-    if (this->link == TYPE_PIPE) {
+    if (this->link == TYPE_PIPE || this->fanout) {
         // Parent is piped to something
         if (pipe(this->pfd) == -1) {
             error_msg();
@@ -124,10 +305,11 @@ void command::run() {
     }
 
     int m = 0;
-    if (this->args[0] == "cd") {
+    bool cd = !this->loop && argv[0] == "cd";
+    if (cd) {
         // Handle redirects if any
         // Change directory
-        m = chdir(this->args[1].c_str());
+        m = chdir(argv[1].c_str());
     }
 
     // Fork current process 
@@ -137,8 +319,13 @@ void command::run() {
     }
     if (child_pid == 0) {
         // Child process executes this code
+        for (int fd : shell_fds) {
+            close(fd);
+        }
+        shell_fds.clear();
+
         // Connect pipes if any
-        if (this->args[0] == "cd") {
+        if (cd) {
             if (m == -1) {
                 _exit(EXIT_FAILURE);
             } else {
@@ -150,30 +337,61 @@ void command::run() {
             // Something is piped to this
             connect_pipes(this->prev, 0, STDIN_FILENO);
         }
-        if (this->link == TYPE_PIPE) {
+        if (this->fanin >= 0) {
+            // The `|&|` pump feeds this
+            if (dup2(this->fanin, STDIN_FILENO) == -1 || close(this->fanin) == -1) {
+                error_msg();
+            }
+        }
+        if (this->link == TYPE_PIPE || this->fanout) {
             // This is piped to something
             connect_pipes(this, 1, STDOUT_FILENO);
             if (close(this->pfd[0]) == -1) {
                 error_msg();
             }
         }
+        if (!subfds.empty()) {
+            // Keep only the process substitution pipes
+            close_other_fds(subfds);
+        }
         
         // Handle redirects if any
         if (this->in) {
-            redir(this->inpath, O_RDONLY, STDIN_FILENO);
+            redir(expand(this->inpath), O_RDONLY, STDIN_FILENO);
         }
         if (this->out) {
-            redir(this->outpath, O_CREAT | O_WRONLY, STDOUT_FILENO);
+            redir(expand(this->outpath), O_CREAT | O_WRONLY, STDOUT_FILENO);
         }
         if (this->err) {
-            redir(this->errpath, O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO);
+            redir(expand(this->errpath), O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO);
+        }
+
+        // Run a piped or redirected loop in this subshell
+        if (this->loop) {
+            run_loop(this);
+            _exit(WIFEXITED(this->status) ? WEXITSTATUS(this->status) : EXIT_FAILURE);
+        }
+
+        // Run the `parallel` builtin in this subshell
+        if (!this->loop && argv[0] == "parallel") {
+            _exit(run_parallel(argv));
+        }
+
+        // Run the `cached` builtin in this subshell. Without a `<` or a
+        // pipe, its command reads nothing, not the shell's own input
+        if (!this->loop && argv[0] == "cached") {
+            if (!this->in && this->fanin < 0
+                && !(this->prev && this->prev->link == TYPE_PIPE)) {
+                redir("/dev/null", O_RDONLY, STDIN_FILENO);
+            }
+            _exit(run_cached(argv));
         }
 
         // Create an array of arguments from user input that ends in a nullptr
-        size_t n = this->args.size();
+        size_t n = argv.size();
         const char* str[n + 1];
         for (size_t i = 0; i < n; ++i) {
-            str[i] = this->args[i].c_str();
+            str[i] = argv[i].c_str();
         }
         str[n] = nullptr;
 
@@ -185,13 +403,25 @@ void command::run() {
     // Parent process executes this code
     this->pid = child_pid;
 
+    for (int fd : subfds) {
+        if (close(fd) == -1) {
+            error_msg();
+        }
+    }
+
     if (this->prev && this->prev->link == TYPE_PIPE) {
         // Something is piped to parent
         if (close(this->prev->pfd[0]) == -1) {
             error_msg();
         }
     }
-    if (this->link == TYPE_PIPE) {
+    if (this->fanin >= 0) {
+        if (close(this->fanin) == -1) {
+            error_msg();
+        }
+        this->fanin = -1;
+    }
+    if (this->link == TYPE_PIPE || this->fanout) {
         // Parent is piped to something
         if (close(this->pfd[1]) == -1) {
             error_msg();
@@ -224,20 +454,209 @@ void command::run() {
 //    PART 5: Change the loop to handle background conditional chains.
 //       This may require adding another call to `fork()`!
 
+// splice_all(from, to, n)
+//    Move `n` bytes from pipe `from` to `to` with splice(2), blocking until
+//    `to` has room. Returns the number of bytes moved, which is less than
+//    `n` only if `to` fails (for instance, its reader has exited).
+
+size_t splice_all(int from, int to, size_t n) {
+    size_t moved = 0;
+    while (moved < n) {
+        ssize_t m = splice(from, nullptr, to, nullptr, n - moved, SPLICE_F_MOVE);
+        if (m == -1 && errno != EINTR) {
+            break;
+        } else if (m > 0) {
+            moved += m;
+        }
+    }
+    return moved;
+}
+
+// fanout_pump(in, outs)
+//    Copy everything read from pipe `in` to every pipe in `outs`, dropping
+//    consumers that exit. Each round splices the data waiting in `in` into
+//    a staging pipe, duplicates it with tee(2) into a private pipe for each
+//    consumer but the last, and splices the staging pipe into the last
+//    consumer and each private pipe into its consumer, so the data never
+//    passes through user space. The private pipes are empty at the start
+//    of a round and as large as the staging pipe, so `tee` always copies
+//    the whole round, however full the consumers are. Splices block, so the
+//    pump stops reading `in` (and the producer stops) until the slowest
+//    consumer has taken the round: buffering is bounded by the pipes'
+//    capacity.
+
+void fanout_pump(int in, std::vector<int> outs) {
+    int stage[2];
+    if (pipe(stage) == -1) {
+        error_msg();
+    }
+    // The staging pipe must hold everything `in` can
+    int cap = fcntl(in, F_GETPIPE_SZ);
+    if (cap > fcntl(stage[0], F_GETPIPE_SZ)) {
+        fcntl(stage[0], F_SETPIPE_SZ, cap);
+    }
+    cap = fcntl(stage[0], F_GETPIPE_SZ);
+
+    // Private pipes for all consumers but the last; shrink the staging
+    // pipe if one cannot grow to match it
+    std::vector<int> copy_rd(outs.size(), -1), copy_wr(outs.size(), -1);
+    for (size_t i = 0; i + 1 < outs.size(); ++i) {
+        int cfd[2];
+        if (pipe(cfd) == -1) {
+            error_msg();
+        }
+        if (fcntl(cfd[1], F_SETPIPE_SZ, cap) == -1) {
+            cap = fcntl(stage[0], F_SETPIPE_SZ, fcntl(cfd[1], F_GETPIPE_SZ));
+        }
+        copy_rd[i] = cfd[0];
+        copy_wr[i] = cfd[1];
+    }
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull == -1) {
+        error_msg();
+    }
+
+    while (!outs.empty()) {
+        ssize_t n = splice(in, nullptr, stage[1], nullptr, cap, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+
+        // Duplicate the round into the private pipes
+        size_t last = outs.size() - 1;
+        for (size_t i = 0; i != last; ++i) {
+            ssize_t m;
+            do {
+                m = tee(stage[0], copy_wr[i], n, 0);
+            } while (m == -1 && errno == EINTR);
+            if (m == -1) {
+                error_msg();
+            }
+            assert(m == n);
+        }
+
+        // Move the round into the consumers, discarding what an exited
+        // last consumer did not take
+        std::vector<bool> gone(outs.size());
+        size_t moved = splice_all(stage[0], outs[last], n);
+        if (moved < (size_t) n) {
+            gone[last] = true;
+            splice_all(stage[0], devnull, n - moved);
+        }
+        for (size_t i = 0; i != last; ++i) {
+            gone[i] = splice_all(copy_rd[i], outs[i], n) < (size_t) n;
+        }
+
+        // Drop consumers that have exited
+        for (size_t i = outs.size(); i-- > 0; ) {
+            if (gone[i]) {
+                close(outs[i]);
+                if (copy_rd[i] >= 0) {
+                    close(copy_rd[i]);
+                    close(copy_wr[i]);
+                }
+                outs.erase(outs.begin() + i);
+                copy_rd.erase(copy_rd.begin() + i);
+                copy_wr.erase(copy_wr.begin() + i);
+            }
+        }
+    }
+}
+
+
 void run_pipeline(command* &c) {
-    // Run the pipeline
-    while (c && c->link == TYPE_PIPE) {
+    // Run a loop that stands alone inside the shell, without forking
+    if (c->loop && c->link != TYPE_PIPE && c->link != TYPE_FANOUT
+        && !c->in && !c->out && !c->err) {
+        run_loop(c);
+        return;
+    }
+
+    command* first = c;
+
+    // Run the pipeline. In `producer |&| consumer |&| consumer ...`, each
+    // consumer pipeline reads a copy of the producer's output from its own
+    // pipe, which `fanout_pump` fills.
+    command* producer = nullptr;
+    pid_t pump = -1;
+    std::vector<command*> consumers;   // last command of each consumer
+    std::vector<int> outs;             // pump ends of the consumers' pipes
+    while (c && (c->link == TYPE_PIPE || c->link == TYPE_FANOUT)) {
         // Run all but the last command in a pipeline
+        if (c->link == TYPE_FANOUT && !producer) {
+            producer = c;
+            c->fanout = true;
+        }
         c->run();
+        if (c == producer) {
+            shell_fds.push_back(c->pfd[0]);
+        } else if (c->link == TYPE_FANOUT) {
+            consumers.push_back(c);
+        }
+        if (c->link == TYPE_FANOUT) {
+            // Start the next consumer with its own pipe from the pump
+            int cfd[2];
+            if (pipe(cfd) == -1) {
+                error_msg();
+            }
+            c->next->fanin = cfd[0];
+            outs.push_back(cfd[1]);
+            shell_fds.push_back(cfd[1]);
+        }
         c = c->next;
     }
     // Run last command in a pipeline
     c->run();
 
+    if (producer) {
+        // Run the pump in its own process
+        pump = fork();
+        if (pump == -1) {
+            error_msg();
+        }
+        if (pump == 0) {
+            set_signal_handler(SIGPIPE, SIG_IGN);
+            fanout_pump(producer->pfd[0], outs);
+            _exit(EXIT_SUCCESS);
+        }
+        for (int fd : shell_fds) {
+            close(fd);
+        }
+        shell_fds.clear();
+
+        // A fan-out finishes when all of its consumers do
+        for (command* cc : consumers) {
+            if (waitpid(cc->pid, &cc->status, 0) == -1) {
+                error_msg();
+            }
+        }
+    }
+
     // Wait for output of final command in this pipeline
     if (waitpid(c->pid, &c->status, 0) == -1) {
         error_msg();
     }
+    last_status = c->status;
+
+    if (pump > 0) {
+        // The pump exits at the producer's EOF or when no consumer is left;
+        // then the producer finishes or dies of SIGPIPE
+        if (waitpid(pump, nullptr, 0) == -1
+            || waitpid(producer->pid, nullptr, 0) == -1) {
+            error_msg();
+        }
+    }
+
+    // Reap the pipeline's process substitutions
+    for (command* cc = first; cc != c->next; cc = cc->next) {
+        for (auto& p : cc->procsubs) {
+            if (waitpid(p.pid, nullptr, 0) == -1) {
+                error_msg();
+            }
+        }
+    }
     return;
 }
 
@@ -252,12 +671,14 @@ void run_conditional(command* &c) {
             // Pipeline exited normally
             if (c && WEXITSTATUS(c->status) != 0 && c->link == TYPE_AND) {
                 // Encountered false AND condition, skip all following AND conditions
-                while (c && (c->link == TYPE_AND || c->link == TYPE_PIPE)) {
+                while (c && (c->link == TYPE_AND || c->link == TYPE_PIPE
+                             || c->link == TYPE_FANOUT)) {
                     c = c->next;
                 }
             } else if (c && WEXITSTATUS(c->status) == 0 && c->link == TYPE_OR) {
                 // Encountered true OR condition, skip all following OR conditions
-                while (c && (c->link == TYPE_OR || c->link == TYPE_PIPE)) {
+                while (c && (c->link == TYPE_OR || c->link == TYPE_PIPE
+                             || c->link == TYPE_FANOUT)) {
                     c = c->next;
                 }
             }
@@ -325,70 +746,928 @@ void run_list(command* c) {
 }
 
 
-// parse_line(s)
-//    Parse the command list in `s` and return it. Returns `nullptr` if
-//    `s` is empty (only spaces). You’ll extend it to handle more token
-//    types.
+// reset_list(c)
+//    Mark every command in the list starting at `c` as not running, so that
+//    a loop can run the list again.
 
-// for a tree: return the initial pointer, create structs for each level of the tree struct, 
-// and after we finish a sequence. move all 3 pointers to the next column.
+void reset_list(command* c) {
+    for (; c; c = c->next) {
+        c->pid = -1;
+    }
+}
 
-command* parse_line(const char* s) {
-    shell_parser parser(s);
+
+// run_loop(c)
+//    Run the loop command `c` inside the shell. Its condition and body
+//    lists were parsed once by `parse_line`; each iteration re-runs them
+//    with `run_list`. `for` assigns each word to its variable in `bindings`.
+//    Sets `c->status` to the status of the last body list run, or to 0 if
+//    the body never ran.
+
+void run_loop(command* c) {
+    int status = 0;
+    if (c->loop == LOOP_FOR) {
+        std::vector<std::string> words;
+        for (auto& w : c->words) {
+            words.push_back(expand(w));
+        }
+        for (auto& w : words) {
+            bindings[c->var] = w;
+            reset_list(c->body);
+            run_list(c->body);
+            status = last_status;
+        }
+    } else {
+        while (true) {
+            reset_list(c->cond);
+            run_list(c->cond);
+            bool success = WIFEXITED(last_status) && WEXITSTATUS(last_status) == 0;
+            if (success != (c->loop == LOOP_WHILE)) {
+                break;
+            }
+            reset_list(c->body);
+            run_list(c->body);
+            status = last_status;
+        }
+    }
+    c->status = last_status = status;
+}
+
+
+// is_keyword(it, kw)
+//    Test if the token at `it` is the reserved word `kw`. Reserved words
+//    are only recognized at the start of a command.
+
+bool is_keyword(const shell_token_iterator& it, const char* kw) {
+    return it.type() == TYPE_NORMAL && it.str() == kw;
+}
+
+// Set by `parse_loop` when the command line ends inside a loop
+bool parse_incomplete = false;
+
+command* parse_list(shell_token_iterator& it, shell_token_iterator end, bool& ok);
+
+
+// parse_loop(it, end, ok)
+//    Parse the loop starting at the `for`, `while`, or `until` at `it` into
+//    a single loop command. On return, `it` points at the closing `done`.
+//    Sets `ok` to false on a syntax error.
+
+command* parse_loop(shell_token_iterator& it, shell_token_iterator end, bool& ok) {
+    command* c = new command;
+    if (is_keyword(it, "for")) {
+        c->loop = LOOP_FOR;
+        ++it;
+        if (it.type() != TYPE_NORMAL) {
+            ok = false;
+            return c;
+        }
+        c->var = it.str();
+        ++it;
+        if (!is_keyword(it, "in")) {
+            ok = false;
+            return c;
+        }
+        for (++it; it != end && it.type() == TYPE_NORMAL; ++it) {
+            c->words.push_back(it.word());
+        }
+        if (it == end || it.type() != TYPE_SEQUENCE) {
+            ok = false;
+            return c;
+        }
+        // `do` may follow on a later line
+        do {
+            ++it;
+        } while (it != end && it.str() == "\n");
+    } else {
+        c->loop = is_keyword(it, "while") ? LOOP_WHILE : LOOP_UNTIL;
+        ++it;
+        c->cond = parse_list(it, end, ok);
+        if (!c->cond) {
+            ok = false;
+        }
+    }
+
+    if (!ok || !is_keyword(it, "do")) {
+        ok = false;
+        return c;
+    }
+    ++it;
+    c->body = parse_list(it, end, ok);
+    if (!c->body || !is_keyword(it, "done")) {
+        ok = false;
+    }
+    return c;
+}
+
+
+// parse_procsub(it, end, ok)
+//    Parse the process substitution starting at the `<(` or `>(` at `it`.
+//    On return, `it` points at the closing `)`. Sets `ok` to false on a
+//    syntax error.
+
+procsub parse_procsub(shell_token_iterator& it, shell_token_iterator end, bool& ok) {
+    procsub p;
+    p.write = it.str() == ">(";
+    ++it;
+    p.list = parse_list(it, end, ok);
+    if (!p.list || it.type() != TYPE_RPAREN) {
+        ok = false;
+    }
+    return p;
+}
+
+
+// parse_list(it, end, ok)
+//    Parse a command list starting at `it`. Stops at `end`, at a `do` or
+//    `done` that closes an enclosing loop, or at a `)` that closes a process
+//    substitution, leaving `it` there. Sets `ok` to false on a syntax error.
+
+command* parse_list(shell_token_iterator& it, shell_token_iterator end, bool& ok) {
     command* chead = nullptr;    // first command in list
     command* clast = nullptr;    // last command in list
     command* ccur = nullptr;     // current command being built
-    for (auto it = parser.begin(); it != parser.end(); ++it) {
+    for (; ok && it != end; ++it) {
         switch (it.type()) {
         case TYPE_NORMAL:
+            if (!ccur && (is_keyword(it, "do") || is_keyword(it, "done"))) {
+                // End of a loop's list, which must not end in `&&`, `||`,
+                // or `|`
+                if (clast && clast->link != TYPE_SEQUENCE
+                    && clast->link != TYPE_BACKGROUND) {
+                    ok = false;
+                }
+                return chead;
+            }
             // Add a new argument to the current command.
             // Might require creating a new command.
             if (!ccur) {
-                ccur = new command;
+                if (is_keyword(it, "for") || is_keyword(it, "while")
+                    || is_keyword(it, "until")) {
+                    ccur = parse_loop(it, end, ok);
+                    if (!ok && it == end) {
+                        parse_incomplete = true;
+                    }
+                } else {
+                    ccur = new command;
+                }
                 if (clast) {
                     clast->next = ccur;
                     ccur->prev = clast;
                 } else {
                     chead = ccur;
                 }
+                if (ccur->loop) {
+                    break;
+                }
+            } else if (ccur->loop) {
+                // Words may not follow `done`
+                ok = false;
+                break;
             }
-            ccur->args.push_back(it.str());
+            ccur->args.push_back(it.word());
             break;
-        case TYPE_REDIRECT_OP:
-            assert(ccur);
+        case TYPE_REDIRECT_OP: {
+            std::string op = it.str();
+            ++it;
+            if (!ccur || (op != "<" && op != ">" && op != "2>")) {
+                ok = false;
+                break;
+            }
             clast = ccur;
 
             // Save the most recent redirect operation and its path
-            if (it.str() == "<") {
+            std::string* path;
+            if (op == "<") {
                 clast->in = true;
-                ++it;
-                clast->inpath = it.str();
-            }
-            if (it.str() == ">") {
+                path = &clast->inpath;
+            } else if (op == ">") {
                 clast->out = true;
-                ++it;
-                clast->outpath = it.str();
-            }
-            if (it.str() == "2>") {
+                path = &clast->outpath;
+            } else {
                 clast->err = true;
-                ++it;
-                clast->errpath = it.str();
+                path = &clast->errpath;
+            }
+            if (it.type() == TYPE_NORMAL) {
+                *path = it.word();
+            } else if (it.type() == TYPE_PROCSUB) {
+                // The path is filled in when the command runs
+                procsub p = parse_procsub(it, end, ok);
+                p.path = path;
+                clast->procsubs.push_back(p);
+            } else {
+                ok = false;
+            }
+            break;
+        }
+        case TYPE_PROCSUB: {
+            // The word is filled in when the command runs
+            if (!ccur || ccur->loop) {
+                ok = false;
+                break;
             }
-            assert(it.type() == TYPE_NORMAL);
+            procsub p = parse_procsub(it, end, ok);
+            p.arg = ccur->args.size();
+            ccur->procsubs.push_back(p);
+            ccur->args.push_back("");
             break;
+        }
+        case TYPE_RPAREN:
+            // End of a process substitution's list
+            if (!ccur && clast && clast->link != TYPE_SEQUENCE
+                && clast->link != TYPE_BACKGROUND) {
+                ok = false;
+            }
+            return chead;
         case TYPE_SEQUENCE:
         case TYPE_BACKGROUND:
         case TYPE_PIPE:
+        case TYPE_FANOUT:
         case TYPE_AND:
         case TYPE_OR:
             // These operators terminate the current command.
-            assert(ccur);
+            if (!ccur) {
+                // Blank lines are fine; empty commands are not
+                ok = it.str() == "\n";
+                break;
+            }
             clast = ccur;
             clast->link = it.type();
             ccur = nullptr;
             break;
         }
     }
+    if (!ccur && clast
+        && (clast->link == TYPE_PIPE || clast->link == TYPE_FANOUT)) {
+        // Pipeline missing its last command
+        ok = false;
+    }
+    return chead;
+}
+
+
+// PARALLEL BUILTIN
+
+// parallel_job
+//    One worker slot of the `parallel` builtin.
+
+struct parallel_job {
+    command* c = nullptr;         // running job, nullptr if the slot is free
+    size_t seq;                   // input position of the job's item
+    std::string output;           // job's buffered stdout
+    bool eof;                     // true once the job's stdout is closed
+    bool reaped;                  // true once the job has been waited for
+    int status;
+    double start;                 // time the job started
+};
+
+// Helper function returning the current time in seconds
+double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Self-pipe written on SIGCHLD, so `poll` wakes when a job exits
+int sigchld_pipe[2] = {-1, -1};
+pid_t sigchld_owner = -1;
+
+void sigchld_handler(int) {
+    // Forked jobs inherit the handler until they exec; only the owner writes
+    int saved_errno = errno;
+    if (getpid() == sigchld_owner) {
+        ssize_t r = write(sigchld_pipe[1], "", 1);
+        (void) r;
+    }
+    errno = saved_errno;
+}
+
+
+
+// run_parallel(argv)
+//    Run the `parallel` builtin, whose arguments are in `argv`:
+//
+//        parallel [-j N] [-k] [-s] [-a FILE] COMMAND...
+//
+//    Each line read from FILE (or standard input) is one item. Every `{}`
+//    in COMMAND is replaced by the item; if COMMAND has no `{}`, the item
+//    is appended as its last argument. Up to N jobs (default: the number of
+//    CPUs) run at a time, started with `command::run`; whenever a job
+//    finishes, its slot takes the next item. Each job's standard output is
+//    buffered in memory and written when the job finishes, in input order
+//    with `-k`. `-s` reports throughput and job latency on standard error.
+//    Every job is reaped before the next item is started in its slot.
+//
+//    Called in a subshell. Returns 0 if all jobs succeeded, 1 otherwise.
+
+int run_parallel(const std::vector<std::string>& argv) {
+    long njobs = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    bool keep_order = false;
+    bool stats = false;
+    const char* path = nullptr;
+    size_t i = 1;
+    for (; i < argv.size() && argv[i].size() > 1 && argv[i][0] == '-'; ++i) {
+        if (argv[i] == "-k") {
+            keep_order = true;
+        } else if (argv[i] == "-s") {
+            stats = true;
+        } else if (argv[i] == "-j" && i + 1 < argv.size()) {
+            njobs = strtol(argv[++i].c_str(), nullptr, 10);
+        } else if (argv[i].compare(0, 2, "-j") == 0) {
+            njobs = strtol(argv[i].c_str() + 2, nullptr, 10);
+        } else if (argv[i] == "-a" && i + 1 < argv.size()) {
+            path = argv[++i].c_str();
+        } else {
+            break;
+        }
+    }
+    if (i == argv.size() || njobs < 1) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [-s] [-a FILE] COMMAND...\n");
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> tmpl(argv.begin() + i, argv.end());
+    bool has_slot = std::any_of(tmpl.begin(), tmpl.end(), [] (const std::string& a) {
+        return a.find("{}") != std::string::npos;
+    });
+
+    FILE* items = stdin;
+    if (path && !(items = fopen(path, "re"))) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    // Items are not loop words: keep jobs from expanding `$name` in them
+    bindings.clear();
+
+    // Wake on SIGCHLD; restart reads of items the signal interrupts
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        error_msg();
+    }
+    shell_fds.push_back(sigchld_pipe[0]);
+    shell_fds.push_back(sigchld_pipe[1]);
+    sigchld_owner = getpid();
+    struct sigaction sa;
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, nullptr) == -1) {
+        error_msg();
+    }
+
+    std::vector<parallel_job> slots(njobs);
+    std::map<size_t, std::string> done_output;   // finished, not yet written
+    std::vector<double> latency;
+    size_t nitems = 0, nactive = 0, nfailed = 0, next_write = 0;
+    bool more = true;
+    char* line = nullptr;
+    size_t linecap = 0;
+    double start = now();
+    std::vector<pollfd> pfds;
+    std::vector<parallel_job*> polled;
+
+    while (more || nactive) {
+        // Start jobs in free slots
+        for (auto& j : slots) {
+            if (j.c || !more) {
+                continue;
+            }
+            ssize_t len = getline(&line, &linecap, items);
+            if (len == -1) {
+                more = false;
+                break;
+            }
+            if (len > 0 && line[len - 1] == '\n') {
+                line[--len] = '\0';
+            }
+            std::string item(line, len);
+
+            j.c = new command;
+            for (auto& a : tmpl) {
+                std::string arg = a;
+                for (size_t p = 0; (p = arg.find("{}", p)) != std::string::npos; p += item.size()) {
+                    arg.replace(p, 2, item);
+                }
+                j.c->args.push_back(arg);
+            }
+            if (!has_slot) {
+                j.c->args.push_back(item);
+            }
+            // Capture the job's stdout; keep it off the item stream
+            j.c->link = TYPE_PIPE;
+            j.c->in = true;
+            j.c->inpath = "/dev/null";
+            j.start = now();
+            j.c->run();
+            fcntl(j.c->pfd[0], F_SETFD, FD_CLOEXEC);
+            j.seq = nitems++;
+            j.output.clear();
+            j.eof = j.reaped = false;
+            ++nactive;
+        }
+        if (!nactive) {
+            break;
+        }
+
+        // Wait for output from running jobs or for one to exit;
+        // `pfds[k + 1]` is the output of job `polled[k]`
+        pfds.assign(1, {sigchld_pipe[0], POLLIN, 0});
+        polled.clear();
+        for (auto& j : slots) {
+            if (j.c && !j.eof) {
+                pfds.push_back({j.c->pfd[0], POLLIN, 0});
+                polled.push_back(&j);
+            }
+        }
+        if (poll(pfds.data(), pfds.size(), -1) == -1 && errno != EINTR) {
+            error_msg();
+        }
+        char buf[BUFSIZ];
+        while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+        }
+        for (size_t k = 0; k != polled.size(); ++k) {
+            if (!pfds[k + 1].revents) {
+                continue;
+            }
+            parallel_job& j = *polled[k];
+            ssize_t n = read(j.c->pfd[0], buf, sizeof(buf));
+            if (n > 0) {
+                j.output.append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(j.c->pfd[0]);
+                j.eof = true;
+            }
+        }
+
+        // Reap exited jobs; the self-pipe was drained first, so a job that
+        // exits after this loop wakes the next `poll`
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (auto& j : slots) {
+                if (j.c && j.c->pid == pid) {
+                    j.reaped = true;
+                    j.status = status;
+                }
+            }
+        }
+
+        // Finish jobs and free their slots
+        for (auto& j : slots) {
+            if (!j.c || !j.eof || !j.reaped) {
+                continue;
+            }
+            latency.push_back(now() - j.start);
+            if (!WIFEXITED(j.status) || WEXITSTATUS(j.status) != 0) {
+                ++nfailed;
+            }
+            if (keep_order) {
+                done_output[j.seq] = std::move(j.output);
+                for (auto it = done_output.begin();
+                     it != done_output.end() && it->first == next_write;
+                     it = done_output.erase(it), ++next_write) {
+                    write_all(STDOUT_FILENO, it->second);
+                }
+            } else {
+                write_all(STDOUT_FILENO, j.output);
+            }
+            delete j.c;
+            j.c = nullptr;
+            --nactive;
+        }
+    }
+    free(line);
+    if (items != stdin) {
+        fclose(items);
+    }
+
+    if (stats) {
+        double elapsed = now() - start;
+        auto pct = [&] (double p) {
+            if (latency.empty()) {
+                return 0.0;
+            }
+            auto it = latency.begin() + (size_t) (p * (latency.size() - 1));
+            std::nth_element(latency.begin(), it, latency.end());
+            return *it * 1000;
+        };
+        fprintf(stderr, "parallel: %zu items in %.3f s (%.1f items/s), %zu failed\n",
+                nitems, elapsed, elapsed > 0 ? nitems / elapsed : 0.0, nfailed);
+        fprintf(stderr, "parallel: latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                pct(0.5), pct(0.9), pct(0.99), pct(1.0));
+    }
+    return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+// RESULT CACHE
+
+// Environment variables that can change a cached command's result
+const char* const cache_env[] = {
+    "PATH", "HOME", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_NUMERIC",
+    "TZ"
+};
+
+// Default cache size limit in bytes
+#define CACHE_MAX_SIZE     (256L << 20)
+
+// Helper function appending the identity of file `st` to cache key `key`
+void add_file_identity(std::string& key, const struct stat& st) {
+    key += std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":"
+        + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec)
+        + "." + std::to_string(st.st_mtim.tv_nsec);
+    key += '\0';
+}
+
+// Helper function appending the identity of input `st` to cache key `key`.
+// A directory's mtime changes with its entries. Returns false for input
+// whose contents cannot be keyed: a pipe, socket, or device other than
+// `/dev/null`.
+bool add_input_identity(std::string& key, const struct stat& st) {
+    struct stat null_st;
+    if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+        add_file_identity(key, st);
+        return true;
+    }
+    return S_ISCHR(st.st_mode) && stat("/dev/null", &null_st) == 0
+        && st.st_rdev == null_st.st_rdev;
+}
+
+// Helper function returning the 128-bit FNV-1a hash of `s` in hex
+std::string hash_hex(const std::string& s) {
+    unsigned __int128 h = ((unsigned __int128) 0x6c62272e07bb0142ULL << 64)
+        | 0x62b821756295c58dULL;
+    unsigned __int128 prime = ((unsigned __int128) 1 << 88) + 0x13b;
+    for (unsigned char ch : s) {
+        h = (h ^ ch) * prime;
+    }
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+             (unsigned long long) (h >> 64), (unsigned long long) h);
+    return buf;
+}
+
+
+// cache_key(argv, key)
+//    Compute the cache key for running `argv` with the current working
+//    directory, environment, and standard input. The key covers the words,
+//    the resolved executable's identity, the directory, the `cache_env`
+//    variables, and the identity (device, inode, size, and mtime) of
+//    standard input and of every word that names a file or directory.
+//    Returns false if the result cannot be cached: standard output is a
+//    terminal (commands like `ls` format for it, but a miss stores output
+//    through a file), the executable is not found, or standard input or a
+//    word is a pipe, socket, or device other than `/dev/null` (such as a
+//    `<(list)` substitution's `/dev/fd/N`).
+//    `command::run` opens `/dev/null` as standard input for `cached`
+//    without a `<` redirection or pipe, so a terminal or script that the
+//    shell reads from does not stop caching.
+
+bool cache_key(const std::vector<std::string>& argv, std::string& key) {
+    if (isatty(STDOUT_FILENO)) {
+        return false;
+    }
+
+    std::string k = "sh61-cache-1";
+    k += '\0';
+    for (auto& a : argv) {
+        k += a;
+        k += '\0';
+    }
+
+    // Resolve the executable as `execvp` would
+    struct stat st;
+    bool found = false;
+    if (argv[0].find('/') != std::string::npos) {
+        found = stat(argv[0].c_str(), &st) == 0;
+    } else {
+        const char* path = getenv("PATH");
+        std::string dirs = path ? path : "/bin:/usr/bin";
+        size_t pos = 0;
+        while (!found && pos <= dirs.size()) {
+            size_t colon = std::min(dirs.find(':', pos), dirs.size());
+            std::string dir = dirs.substr(pos, colon - pos);
+            std::string file = (dir.empty() ? "." : dir) + "/" + argv[0];
+            found = access(file.c_str(), X_OK) == 0
+                && stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+            pos = colon + 1;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    add_file_identity(k, st);
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return false;
+    }
+    k += cwd;
+    k += '\0';
+    for (const char* name : cache_env) {
+        const char* value = getenv(name);
+        k += std::string(name) + "=" + (value ? value : "");
+        k += '\0';
+    }
+
+    // Input files; a terminal or other device could be read differently
+    // each time
+    if (fstat(STDIN_FILENO, &st) == 0 && !add_input_identity(k, st)) {
+        return false;
+    }
+    for (size_t i = 1; i < argv.size(); ++i) {
+        if (argv[i].compare(0, 8, "/dev/fd/") == 0) {
+            return false;
+        }
+        if (stat(argv[i].c_str(), &st) == 0 && !add_input_identity(k, st)) {
+            return false;
+        }
+    }
+
+    key = hash_hex(k);
+    return true;
+}
+
+
+// copy_out(src, dst)
+//    Copy all of file `src` to `dst`: by reflink if `dst` is an empty
+//    regular file on a filesystem that supports it, else in the kernel with
+//    `copy_file_range` or `sendfile`, else with reads and writes.
+
+bool copy_out(int src, int dst) {
+    struct stat st, dst_st;
+    if (fstat(src, &st) == -1 || fstat(dst, &dst_st) == -1) {
+        return false;
+    }
+    if (S_ISREG(dst_st.st_mode) && lseek(dst, 0, SEEK_CUR) == 0
+        && ioctl(dst, FICLONE, src) == 0) {
+        return lseek(dst, 0, SEEK_END) != -1;
+    }
+    off_t pos = 0;
+    while (pos < st.st_size) {
+        ssize_t n;
+        if (S_ISREG(dst_st.st_mode)) {
+            n = copy_file_range(src, &pos, dst, nullptr, st.st_size - pos, 0);
+        } else {
+            n = sendfile(dst, src, &pos, st.st_size - pos);
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+    }
+    if (pos < st.st_size) {
+        // Kernel copy not supported here
+        if (lseek(src, pos, SEEK_SET) == -1) {
+            return false;
+        }
+        char buf[BUFSIZ];
+        ssize_t n;
+        while ((n = read(src, buf, sizeof(buf))) != 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n == -1 || !write_all(dst, std::string(buf, n))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// cache_stats(dir, hit)
+//    Count a hit (if `hit` is 1) or a miss (if `hit` is 0) in the `stats`
+//    file of cache directory `dir`, and return the totals in `hits` and
+//    `misses`. `hit` of -1 only reads the totals.
+
+void cache_stats(const std::string& dir, int hit, long& hits, long& misses) {
+    hits = misses = 0;
+    int fd = open((dir + "/stats").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    char buf[64] = "";
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[std::max(n, (ssize_t) 0)] = '\0';
+    sscanf(buf, "%ld %ld", &hits, &misses);
+    if (hit >= 0) {
+        ++(hit ? hits : misses);
+        int len = snprintf(buf, sizeof(buf), "%ld %ld\n", hits, misses);
+        if (pwrite(fd, buf, len, 0) == len) {
+            ftruncate(fd, len);
+        }
+    }
+    close(fd);
+}
+
+
+// cache_evict(dir, max_size)
+//    Remove the least recently used entries from cache directory `dir`
+//    until its entries take at most `max_size` bytes. An entry's mtime is
+//    its last use.
+
+void cache_evict(const std::string& dir, long max_size) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    std::vector<std::pair<timespec, std::string>> entries;
+    long total = 0;
+    while (dirent* de = readdir(d)) {
+        std::string name = de->d_name;
+        struct stat st;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".out") == 0
+            && stat((dir + "/" + name).c_str(), &st) == 0) {
+            total += st.st_size;
+            entries.push_back({st.st_mtim, name.substr(0, name.size() - 4)});
+        }
+    }
+    closedir(d);
+    if (total <= max_size) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [] (const auto& a, const auto& b) {
+        return a.first.tv_sec < b.first.tv_sec
+            || (a.first.tv_sec == b.first.tv_sec && a.first.tv_nsec < b.first.tv_nsec);
+    });
+    for (auto& e : entries) {
+        if (total <= max_size) {
+            break;
+        }
+        std::string path = dir + "/" + e.second;
+        struct stat st;
+        if (stat((path + ".out").c_str(), &st) == 0) {
+            total -= st.st_size;
+        }
+        unlink((path + ".out").c_str());
+        unlink((path + ".status").c_str());
+    }
+}
+
+
+// run_cached(argv)
+//    Run the `cached` builtin, whose arguments are in `argv`:
+//
+//        cached [-d DIR] [-m MAXBYTES] COMMAND...
+//        cached [-d DIR] -s
+//
+//    Look up COMMAND's result in cache directory DIR (default
+//    `$HOME/.cache/sh61`), keyed by `cache_key`. On a hit, write the stored
+//    standard output with `copy_out` and exit with the stored status,
+//    without running COMMAND. On a miss, run COMMAND with `command::run`,
+//    storing its standard output (but not its standard error), then write
+//    it out and store the result if COMMAND exited normally. `>` outputs
+//    are COMMAND's standard output, so they are restored too. Afterward,
+//    the least recently used entries are evicted until the cache holds at
+//    most MAXBYTES (default 256 MiB). `-s` prints hit and miss counts.
+//    Commands whose results cannot be keyed simply run.
+//
+//    Called in a subshell. Returns the exit status for the subshell.
+
+int run_cached(const std::vector<std::string>& argv) {
+    std::string dir;
+    long max_size = CACHE_MAX_SIZE;
+    bool stats = false;
+    size_t i = 1;
+    for (; i < argv.size() && argv[i].size() > 1 && argv[i][0] == '-'; ++i) {
+        if (argv[i] == "-s") {
+            stats = true;
+        } else if (argv[i] == "-d" && i + 1 < argv.size()) {
+            dir = argv[++i];
+        } else if (argv[i] == "-m" && i + 1 < argv.size()) {
+            max_size = strtol(argv[++i].c_str(), nullptr, 10);
+        } else {
+            break;
+        }
+    }
+    if (i == argv.size() && !stats) {
+        fprintf(stderr, "usage: cached [-d DIR] [-m MAXBYTES] COMMAND...\n"
+                "       cached [-d DIR] -s\n");
+        return EXIT_FAILURE;
+    }
+    if (dir.empty()) {
+        const char* home = getenv("HOME");
+        dir = std::string(home ? home : "/tmp") + "/.cache";
+        mkdir(dir.c_str(), 0777);
+        dir += "/sh61";
+    }
+    if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST) {
+        perror(dir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    long hits, misses;
+    if (stats) {
+        cache_stats(dir, -1, hits, misses);
+        long total = hits + misses;
+        printf("cached: %ld hits, %ld misses (%.1f%% hit rate)\n",
+               hits, misses, total ? 100.0 * hits / total : 0.0);
+        fflush(stdout);
+        return EXIT_SUCCESS;
+    }
+
+    // Words are expanded already
+    bindings.clear();
+    command c;
+    c.args.assign(argv.begin() + i, argv.end());
+    std::string key;
+    if (!cache_key(c.args, key)) {
+        c.run();
+        if (waitpid(c.pid, &c.status, 0) == -1) {
+            error_msg();
+        }
+        return WIFEXITED(c.status) ? WEXITSTATUS(c.status) : EXIT_FAILURE;
+    }
+    std::string entry = dir + "/" + key;
+
+    // Hit: replay the stored output and status
+    int fd = open((entry + ".out").c_str(), O_RDONLY | O_CLOEXEC);
+    FILE* f = fopen((entry + ".status").c_str(), "re");
+    int status;
+    if (fd != -1 && f && fscanf(f, "%d", &status) == 1) {
+        fclose(f);
+        futimens(fd, nullptr);
+        bool ok = copy_out(fd, STDOUT_FILENO);
+        close(fd);
+        cache_stats(dir, 1, hits, misses);
+        return ok ? status : EXIT_FAILURE;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    // Miss: run the command with its output in a new entry
+    std::string tmp = dir + "/tmp.XXXXXX";
+    fd = mkstemp(&tmp[0]);
+    if (fd == -1) {
+        error_msg();
+    }
+    close(fd);
+    c.out = true;
+    c.outpath = tmp;
+    c.run();
+    if (waitpid(c.pid, &c.status, 0) == -1) {
+        error_msg();
+    }
+    fd = open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = fd != -1 && copy_out(fd, STDOUT_FILENO);
+    if (fd != -1) {
+        close(fd);
+    }
+    cache_stats(dir, 0, hits, misses);
+    if (!WIFEXITED(c.status)) {
+        unlink(tmp.c_str());
+        return EXIT_FAILURE;
+    }
+    status = WEXITSTATUS(c.status);
+
+    // Store the status first: an entry counts once its output exists
+    f = fopen((entry + ".status").c_str(), "we");
+    if (f && fprintf(f, "%d\n", status) > 0 && fclose(f) == 0
+        && rename(tmp.c_str(), (entry + ".out").c_str()) == 0) {
+        cache_evict(dir, max_size);
+    } else {
+        unlink(tmp.c_str());
+    }
+    return ok ? status : EXIT_FAILURE;
+}
+
+
+// parse_line(s, incomplete)
+//    Parse the command list in `s` and return it. Returns `nullptr` if
+//    `s` is empty (only spaces) or, after printing an error, if `s` has
+//    a syntax error. If `incomplete` is non-null and `s` ends inside a
+//    loop, sets `*incomplete` and returns `nullptr` without an error, so
+//    the caller can read more lines.
+
+// for a tree: return the initial pointer, create structs for each level of the tree struct, 
+// and after we finish a sequence. move all 3 pointers to the next column.
+
+command* parse_line(const char* s, bool* incomplete = nullptr) {
+    shell_parser parser(s);
+    auto it = parser.begin();
+    bool ok = true;
+    parse_incomplete = false;
+    command* chead = parse_list(it, parser.end(), ok);
+    if (!ok && parse_incomplete && incomplete) {
+        *incomplete = true;
+        delete chead;
+        return nullptr;
+    }
+    if (ok && it != parser.end()) {
+        // Stray `do`, `done`, or `)`
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "sh61: syntax error\n");
+        delete chead;
+        return nullptr;
+    }
     return chead;
 }
 
@@ -421,10 +1700,15 @@ int main(int argc, char* argv[]) {
     char buf[BUFSIZ];
     int bufpos = 0;
     bool needprompt = true;
+    std::string pending;    // lines of a loop that is not closed yet
 
     while (!feof(command_file)) {
         // Print the prompt at the beginning of the line
-        if (needprompt && !quiet) {
+        if (needprompt && !quiet && !pending.empty()) {
+            printf("> ");
+            fflush(stdout);
+            needprompt = false;
+        } else if (needprompt && !quiet) {
             printf("sh61[%d]$ ", getpid());
             fflush(stdout);
             needprompt = false;
@@ -447,10 +1731,16 @@ int main(int argc, char* argv[]) {
         // If a complete command line has been provided, run it
         bufpos = strlen(buf);
         if (bufpos == BUFSIZ - 1 || (bufpos > 0 && buf[bufpos - 1] == '\n')) {
-            if (command* c = parse_line(buf)) {
+            // Parse once the line closes every loop it opens
+            pending += buf;
+            bool incomplete = false;
+            if (command* c = parse_line(pending.c_str(), &incomplete)) {
                 run_list(c);
                 delete c;
             }
+            if (!incomplete) {
+                pending.clear();
+            }
             bufpos = 0;
             needprompt = 1;
         }
@@ -459,5 +1749,14 @@ int main(int argc, char* argv[]) {
         // Your code here!
     }
 
+    // Run a last line that has no newline, or report a loop left open at
+    // end of file
+    buf[bufpos] = 0;
+    pending += buf;
+    if (command* c = parse_line(pending.c_str())) {
+        run_list(c);
+        delete c;
+    }
+
     return 0;
 }
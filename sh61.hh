@@ -22,8 +22,14 @@
 // some other token types to get you started.
 #define TYPE_LPAREN        7   // `(` operator
 #define TYPE_RPAREN        8   // `)` operator
+#define TYPE_FANOUT        9   // `|&|` fan-out operator
+#define TYPE_PROCSUB       10  // `<(` or `>(` process substitution
 #define TYPE_OTHER         -1
 
+// `shell_token_iterator::word()` puts this before each quoted `$`, which
+// must not start a variable expansion
+#define LITERAL_DOLLAR     '\x1f'
+
 struct shell_token_iterator;
 
 
@@ -61,6 +67,7 @@ private:
 
 struct shell_token_iterator {
     std::string str() const;    // current token’s character contents
+    std::string word() const;   // `str()`, marking quoted `$` characters
     inline int type() const;    // current token’s type
 
     // compare iterators